@@ -0,0 +1,180 @@
+"""
+Benchmark sweep for the attention kernels in module.cpp.
+
+Runs every requested kernel over a grid of N, d, B, H, thread counts and tile sizes and reports
+min/median/p99 latency, achieved GFLOP/s and GB/s, the fraction of the machine roofline that
+is reached (peak GFLOP/s and copy bandwidth are measured at start-up), and the scaling
+efficiency against the smallest thread count in the sweep. --profile adds the share of cycles
+the fused and flash kernels spend in each phase and their load imbalance, from the module's own
+counters. --json writes everything to a file so runs can be compared across builds.
+
+    python3 bench.py --N 512 1024 2048 --threads 1 4 8 --kernels fused flash --json bench.json
+"""
+import argparse
+import json
+import platform
+import time
+from os import environ
+
+import torch
+from torch.utils.cpp_extension import load
+
+from build_ext import extension_build
+
+KERNELS = ["naive", "blocked", "fused", "flash"]
+PHASES = ["copy", "qk", "softmax", "pv", "writeback"]
+DTYPES = {"float32": torch.float32, "bfloat16": torch.bfloat16, "float16": torch.float16}
+
+def measure_roofline(threads):
+    """ Peak GFLOP/s from a large fp32 matmul and GB/s from a large copy, at this thread count """
+    torch.set_num_threads(threads)
+    a, b = torch.randn(2048, 2048), torch.randn(2048, 2048)
+    gflops = 2 * 2048 ** 3 / min(timed(lambda: a @ b, 5)) / 1e9
+    src, dst = torch.empty(64 << 20), torch.empty(64 << 20)
+    # a copy reads and writes every byte
+    gbps = 2 * src.numel() * 4 / min(timed(lambda: dst.copy_(src), 5)) / 1e9
+    return {"threads": threads, "peak_gflops": gflops, "bandwidth_gbps": gbps}
+
+def timed(fn, reps, warmup=1):
+    for _ in range(warmup):
+        fn()
+    times = []
+    for _ in range(reps):
+        start = time.perf_counter()
+        fn()
+        times.append(time.perf_counter() - start)
+    return times
+
+def percentile(sorted_times, q):
+    return sorted_times[min(len(sorted_times) - 1, int(round(q * (len(sorted_times) - 1))))]
+
+def work(kernel, N, d, B, H, causal, dtype):
+    """ Floating point operations and modelled DRAM traffic of one call """
+    # QK^T and PV are 2 * N * N * d flops each; a causal mask skips about half
+    pairs = N * (N + 1) / 2 if causal else N * N
+    flops = B * H * 4 * pairs * d
+    element = torch.finfo(dtype).bits // 8
+    # Q, K, V read and O written once; the unfused kernels also write and reread the fp32 scores
+    traffic = B * H * 4 * N * d * element
+    if kernel in ("naive", "blocked"):
+        traffic += B * H * 2 * N * N * 4
+    return flops, traffic
+
+def make_call(mr, kernel, Q, K, V, N, d, B, H, Br, Bc, causal):
+    if kernel == "naive":
+        QK_t = torch.zeros(N, N)
+        return lambda: mr.myNaiveAttention(Q, K, V, QK_t, B, H, N, d)
+    if kernel == "blocked":
+        QK_t = torch.zeros(N, N)
+        return lambda: mr.myUnfusedAttentionBlocked(Q, K, V, QK_t, B, H, N, d, block=Br)
+    if kernel == "fused":
+        return lambda: mr.myFusedAttention(Q, K, V, torch.empty(0), B, H, N, d, causal)
+    return lambda: mr.myFlashAttention(Q, K, V, Bc, Br, B, H, N, d, causal)
+
+def phase_profile(mr, call, reps):
+    """ Phase cycle shares and load imbalance over reps profiled calls, or None for kernels without counters """
+    mr.setAttentionProfiling(True, False)
+    mr.resetAttentionStats()
+    for _ in range(reps):
+        call()
+    mr.setAttentionProfiling(False, False)
+    kernels = mr.attentionStats()["kernels"]
+    if not kernels:
+        return None
+    cycles = {phase: sum(k["cycles"][phase] for k in kernels.values()) for phase in PHASES}
+    total = max(sum(cycles.values()), 1)
+    # a profiled call records its own imbalance; take the worst kernel of this configuration
+    return {"phases": {phase: c / total for phase, c in cycles.items()},
+            "imbalance": max(k["imbalance"] for k in kernels.values())}
+
+def main():
+    parser = argparse.ArgumentParser(description="Attention kernel benchmark sweep")
+    parser.add_argument("--kernels", nargs="+", default=KERNELS, choices=KERNELS)
+    parser.add_argument("--N", nargs="+", type=int, default=[512, 1024, 2048])
+    parser.add_argument("--d", nargs="+", type=int, default=[32, 64])
+    parser.add_argument("--B", nargs="+", type=int, default=[1])
+    parser.add_argument("--H", nargs="+", type=int, default=[4])
+    parser.add_argument("--threads", nargs="+", type=int, default=[0], help="thread counts to sweep; 0 is every available CPU")
+    parser.add_argument("--tiles", nargs="+", default=["0:0"],
+                        help="Br:Bc pairs for flash (Br is also the blocked kernel's block); 0 uses the tuned sizes")
+    parser.add_argument("--causal", action="store_true", default=False, help="causal mask; naive and blocked have none and are skipped")
+    parser.add_argument("--dtype", default="float32", choices=list(DTYPES))
+    parser.add_argument("--isa", default="", help="ATTN_ISA for the microkernels (default: best for this CPU)")
+    parser.add_argument("--reps", type=int, default=10)
+    parser.add_argument("--warmup", type=int, default=2)
+    parser.add_argument("--profile", action="store_true", default=False,
+                        help="also report the phase cycle shares and load imbalance of fused and flash, from separate profiled runs")
+    parser.add_argument("--json", default="", help="also write the results to this file")
+    args = parser.parse_args()
+    if args.isa:
+        environ["ATTN_ISA"] = args.isa
+
+    sources, extra_ldflags, defines = extension_build()
+    mr = load(name="custom_module", sources=sources, extra_cflags=["-mavx", "-O3", "-fopenmp"] + defines, extra_ldflags=extra_ldflags)
+    # ascending, so the scaling baseline of every configuration is its smallest thread count
+    threads_list = sorted(set(t if t > 0 else mr.attentionThreads() for t in args.threads))
+    dtype = DTYPES[args.dtype]
+    kernels = [k for k in args.kernels if not (args.causal and k in ("naive", "blocked"))]
+    tiles = [tuple(int(x) for x in t.split(":")) for t in args.tiles]
+    rooflines = {t: measure_roofline(t) for t in threads_list}
+    machine = {"cpu": platform.processor() or platform.machine(), "isa": mr.attentionIsa(), "rooflines": list(rooflines.values())}
+    print("Attention kernels: %s" % machine["isa"])
+    for r in rooflines.values():
+        print("roofline at %d threads: %.1f GFLOP/s, %.1f GB/s" % (r["threads"], r["peak_gflops"], r["bandwidth_gbps"]))
+    print()
+
+    header = "%-8s %5s %4s %3s %3s %4s %9s %9s %9s %9s %8s %8s %8s %6s" % (
+        "kernel", "N", "d", "B", "H", "thr", "Br:Bc", "min ms", "med ms", "p99 ms", "GFLOP/s", "GB/s", "roofline", "scale")
+    if args.profile:
+        header += "".join(" %7s" % phase[:7] for phase in PHASES) + " %6s" % "imbal"
+    print(header)
+    results = []
+    base = {}
+    for kernel in kernels:
+        for N in args.N:
+            for d in args.d:
+                for B in args.B:
+                    for H in args.H:
+                        Q, K, V = (torch.randn(B, H, N, d).to(dtype) for _ in range(3))
+                        flops, traffic = work(kernel, N, d, B, H, args.causal, dtype)
+                        for Br, Bc in tiles if kernel in ("blocked", "flash") else [(0, 0)]:
+                            for threads in threads_list:
+                                mr.setAttentionThreads(threads)
+                                call = make_call(mr, kernel, Q, K, V, N, d, B, H, Br, Bc, args.causal)
+                                times = sorted(timed(call, args.reps, args.warmup))
+                                best, median, p99 = times[0], percentile(times, 0.5), percentile(times, 0.99)
+                                roof = rooflines[threads]
+                                # attainable rate at this kernel's arithmetic intensity
+                                attainable = min(roof["peak_gflops"], flops / traffic * roof["bandwidth_gbps"])
+                                key = (kernel, N, d, B, H, Br, Bc)
+                                base.setdefault(key, (threads, median))
+                                base_threads, base_median = base[key]
+                                result = {"kernel": kernel, "N": N, "d": d, "B": B, "H": H, "threads": threads,
+                                          "Br": Br, "Bc": Bc, "causal": args.causal, "dtype": args.dtype,
+                                          "min_ms": best * 1e3, "median_ms": median * 1e3, "p99_ms": p99 * 1e3,
+                                          "gflops": flops / median / 1e9, "gbps": traffic / median / 1e9,
+                                          "roofline_fraction": flops / median / 1e9 / attainable,
+                                          "scaling_efficiency": base_median * base_threads / (median * threads)}
+                                line = "%-8s %5d %4d %3d %3d %4d %9s %9.3f %9.3f %9.3f %9.2f %8.2f %7.1f%% %6.2f" % (
+                                    kernel, N, d, B, H, threads, "%d:%d" % (Br, Bc), result["min_ms"], result["median_ms"],
+                                    result["p99_ms"], result["gflops"], result["gbps"], 100 * result["roofline_fraction"],
+                                    result["scaling_efficiency"])
+                                if args.profile:
+                                    # profiled separately, so the counters do not slow down the timed runs
+                                    profile = phase_profile(mr, call, args.reps)
+                                    result["profile"] = profile
+                                    if profile is None:
+                                        line += "".join(" %7s" % "-" for _ in PHASES) + " %6s" % "-"
+                                    else:
+                                        line += "".join(" %6.1f%%" % (100 * profile["phases"][phase]) for phase in PHASES)
+                                        line += " %6.2f" % profile["imbalance"]
+                                results.append(result)
+                                print(line)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"machine": machine, "args": vars(args), "results": results}, f, indent=2)
+        print("\nWrote %d results to %s" % (len(results), args.json))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,19 @@
+"""
+How gpt149.py, model.py and bench.py build module.cpp. When ispc is installed and module.ispc is
+newer than module_ispc.o, the ISPC kernels are rebuilt first. When the object exists, it is
+linked and module.cpp is built with -DUSE_ISPC.
+"""
+import shutil
+import subprocess
+from os import getcwd, path
+
+ISPC_FLAGS = ["-O3", "--target=avx2-i32x8", "--arch=x86-64", "--pic"]
+
+def extension_build():
+    """ Returns (sources, extra_ldflags, defines) for torch.utils.cpp_extension.load """
+    ispc_path = getcwd() + "/module_ispc.o"
+    if shutil.which("ispc") and (not path.exists(ispc_path) or path.getmtime(ispc_path) < path.getmtime("module.ispc")):
+        subprocess.run(["ispc"] + ISPC_FLAGS + ["module.ispc", "-h", "module_ispc.h", "-o", ispc_path], check=True)
+    if not path.exists(ispc_path):
+        return ["module.cpp"], [], []
+    return ["module.cpp"], [ispc_path], ["-DUSE_ISPC"]
@@ -5,27 +5,34 @@ import random
 import inspect
 from dataclasses import dataclass
 import sys, getopt
-from os import getcwd, path
+import os
+from os import environ
 import torch
 import torch.nn as nn
 from torch.nn import functional as F
 from torch.utils.cpp_extension import load
 from torch.profiler import profile, record_function, ProfilerActivity
 import module_ref as ms
+from build_ext import extension_build
 
-NUM_THREADS=8
-torch.set_num_threads(NUM_THREADS)
-
-ispc_path = getcwd() + "/module_ispc.o"
-if not path.exists(ispc_path): ispc_path = ""
+sources, extra_ldflags, defines = extension_build()
 
 print("\nCompiling code into a PyTorch module...\n\n")
-mr = load(name="custom_module", sources=["module.cpp"],  extra_cflags=["-mavx", "-O3", "-fopenmp"], extra_ldflags=[ispc_path])
+mr = load(name="custom_module", sources=sources, extra_cflags=["-mavx", "-O3", "-fopenmp"] + defines, extra_ldflags=extra_ldflags)
+# the module sizes its thread pool from the CPUs we may run on (it pins them on the first kernel call); PyTorch uses as many
+torch.set_num_threads(mr.attentionThreads())
 correctness_error_message = "\n-------------------------------------------\n YOUR ATTENTION PRODUCED INCORRECT RESULTS"
 
+# the kernels accumulate in fp32, so half-precision error comes from rounding the inputs and O
+DTYPES = {"float32": torch.float32, "bfloat16": torch.bfloat16, "float16": torch.float16}
+ATOL = {torch.float32: 1e-4, torch.bfloat16: 1e-2, torch.float16: 2e-3}
+
 class CustomAttention(nn.Module):
-    def __init__(self, Q,K,V, B, H, N, d, isRef=False, bc=256, br=256):
+    def __init__(self, Q,K,V, B, H, N, d, isRef=False, bc=256, br=256, causal=False, dtype=torch.float32, schedule="auto"):
         super(nn.Module, self).__init__()
+        # the reference module only takes fp32
+        if not isRef:
+            Q, K, V = Q.to(dtype), K.to(dtype), V.to(dtype)
         self.Q=Q
         self.K=K
         self.V=V
@@ -36,6 +43,8 @@ class CustomAttention(nn.Module):
         self.N=N
         self.d=d
         self.isRef=isRef
+        self.causal=causal
+        self.schedule=schedule
 
     #part 1
     def myUnfusedAttention(self):
@@ -65,16 +74,24 @@ class CustomAttention(nn.Module):
     def myFusedAttention(self):
         if not self.isRef:
             with record_function("STUDENT - FUSED ATTENTION"):
-                temp = torch.zeros((NUM_THREADS, self.N))
-                out = mr.myFusedAttention(self.Q, self.K, self.V, temp, self.B, self.H, self.N, self.d)
+                # row scratch lives in per-thread arenas inside the module, so temp is unused
+                temp = torch.empty(0)
+                out = mr.myFusedAttention(self.Q, self.K, self.V, temp, self.B, self.H, self.N, self.d, self.causal,
+                                          schedule=self.schedule)
             return out
         with record_function("REFERENCE - FUSED ATTENTION"):
-            temp = torch.zeros((NUM_THREADS, self.N))
+            # the reference kernel indexes a row of temp by OpenMP thread number
+            temp = torch.zeros((max(mr.attentionThreads(), os.cpu_count()), self.N))
             out = ms.myFusedAttention(self.Q, self.K, self.V, temp, self.B, self.H, self.N, self.d)
         return out
 
     #part 4
     def myFlashAttention(self):
+        if not self.isRef:
+            # tile scratch lives in per-thread arenas inside the module
+            with record_function("STUDENT - FLASH ATTENTION"):
+                out = mr.myFlashAttention(self.Q, self.K, self.V, self.bc, self.br, self.B, self.H, self.N, self.d, self.causal)
+            return out
         d = self.d
         Qi = torch.zeros((self.br, self.d))
         Kj = torch.zeros((self.bc, self.d))
@@ -87,11 +104,6 @@ class CustomAttention(nn.Module):
         Lnew = torch.zeros((self.br))
         Lij = torch.zeros((self.br))
         Li = torch.zeros((self.br))
-
-        if not self.isRef:
-            with record_function("STUDENT - FLASH ATTENTION"):
-                out = mr.myFlashAttention(self.Q, self.K, self.V, Qi, Kj, Vj, Sij, Pij, PV, Oi, L, Li, Lij, Lnew, self.bc, self.br, self.B, self.H, self.N, self.d)
-            return out
         with record_function("REFERENCE - FLASH ATTENTION"):
             #out = ms.myFlashAttention(self.Q, self.K, self.V, self.B, self.H, self.N, self.d, self.blockSize)
             out = ms.myFlashAttention(self.Q, self.K, self.V, Qi, Kj, Vj, Sij, Pij, PV, Oi, L, Li, Lij, Lnew, self.bc, self.br, self.B, self.H, self.N, self.d)
@@ -142,19 +154,23 @@ def test(Q,K,V):
         print(Q.shape)
         print(Q.stride())
 
-def badSoftmax(Q, K, V):
+def badSoftmax(Q, K, V, causal=False):
     QK = Q @ K.transpose(-2,-1)
+    if causal:
+        # the last query lines up with the last key
+        Nq, Nk = QK.size(-2), QK.size(-1)
+        QK = QK.masked_fill(torch.ones(Nq, Nk).tril(Nk - Nq) == 0, float('-inf'))
     #compute softmax of QK^T
     QKSoftmax = F.softmax(QK, dim=3)
     QKV = QKSoftmax @ V   
     return QKV
 
-def testTemplate(customFunc, params, test_key):
+def testTemplate(customFunc, params, test_key, causal=False, dtype=torch.float32):
     start = time.time()
     N, d, B, H = params
     #compute pytorch unfused softmax
     Q, K, V = createQKVSimple(N,d,B,H)
-    QKV = badSoftmax(Q,K,V)
+    QKV = badSoftmax(Q,K,V,causal)
     end = time.time()
     pytorch_time = end - start
 
@@ -167,8 +183,11 @@ def testTemplate(customFunc, params, test_key):
             end = time.time()
             manual_time = end - start
     
-    assert torch.allclose(QKV,QKS1, atol=1e-4), correctness_error_message
-    print("manual attention == pytorch attention",torch.allclose(QKV,QKS1, atol=1e-4)) 
+    QKS1 = QKS1.float()
+    if dtype != torch.float32:
+        print("%s max abs error vs fp32 reference: %.3e" % (dtype, (QKV - QKS1).abs().max().item()))
+    assert torch.allclose(QKV,QKS1, atol=ATOL[dtype]), correctness_error_message
+    print("manual attention == pytorch attention",torch.allclose(QKV,QKS1, atol=ATOL[dtype])) 
     #print("Pytorch Execution Time:", pytorch_time, "\n")
     print("Manual Execution Time: ", manual_time, "\n")
     print(prof.key_averages().table(sort_by="cpu_memory_usage", row_limit=10))    
@@ -196,53 +215,184 @@ def part0Test(N, d, B, H):
     print(prof.key_averages().table(sort_by="cpu_memory_usage", row_limit=10))
 
 
-def part1Test(N, d, B, H):
+def part1Test(N, d, B, H, dtype=torch.float32):
     print("Running Part 1 Test: Naive Unfused Attention\n")
     Q,K,V = createQKVSimple(N,d,B,H)
-    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d)
+    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d, dtype=dtype)
     attentionModuleReference = CustomAttention(Q,K,V, B, H, N, d, True)
     params = (N, d, B, H)
     print("-----RUNNING REFERENCE IMPLEMENTATION-----\n")
     testTemplate(attentionModuleReference.myUnfusedAttention, params, "REFERENCE - NAIVE ATTENTION")
     time.sleep(3)
     print("-----RUNNING STUDENT IMPLEMENTATION-----\n")
-    testTemplate(attentionModuleStudent.myUnfusedAttention, params, "STUDENT - NAIVE ATTENTION")
+    testTemplate(attentionModuleStudent.myUnfusedAttention, params, "STUDENT - NAIVE ATTENTION", dtype=dtype)
 
-def part2Test(N, d, B, H):
+def part2Test(N, d, B, H, dtype=torch.float32):
     print("Running Part 2 Test: Unfused Attention with Blocked Matmul\n")
     Q,K,V = createQKVSimple(N,d,B,H)
-    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d)
+    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d, dtype=dtype)
     attentionModuleReference = CustomAttention(Q,K,V, B, H, N, d, True)
     params = (N, d, B, H)
     print("-----RUNNING REFERENCE IMPLEMENTATION-----\n")
     testTemplate(attentionModuleReference.myUnfusedAttentionBlocked, params, "REFERENCE - BLOCKED MATMUL + UNFUSED SOFTMAX")
     time.sleep(3)
     print("-----RUNNING STUDENT IMPLEMENTATION-----\n")
-    testTemplate(attentionModuleStudent.myUnfusedAttentionBlocked, params, "STUDENT - BLOCKED MATMUL + UNFUSED SOFTMAX")
+    testTemplate(attentionModuleStudent.myUnfusedAttentionBlocked, params, "STUDENT - BLOCKED MATMUL + UNFUSED SOFTMAX", dtype=dtype)
 
-def part3Test(N, d, B, H):
+def part3Test(N, d, B, H, causal=False, dtype=torch.float32, schedule="auto"):
     print("Running Part 3 Test: Fused Attention\n")
     Q,K,V = createQKVSimple(N,d,B,H)
-    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d)
+    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d, causal=causal, dtype=dtype, schedule=schedule)
     attentionModuleReference = CustomAttention(Q,K,V, B, H, N, d, True)
     params = (N, d, B, H)
-    print("-----RUNNING REFERENCE IMPLEMENTATION-----\n")
-    testTemplate(attentionModuleReference.myFusedAttention, params, "REFERENCE - FUSED ATTENTION")
-    time.sleep(3)
+    if causal:
+        # the reference module has no causal mode; check against masked PyTorch only
+        print("-----SKIPPING REFERENCE IMPLEMENTATION (no causal mode)-----\n")
+    else:
+        print("-----RUNNING REFERENCE IMPLEMENTATION-----\n")
+        testTemplate(attentionModuleReference.myFusedAttention, params, "REFERENCE - FUSED ATTENTION")
+        time.sleep(3)
     print("-----RUNNING STUDENT IMPLEMENTATION-----\n")
-    testTemplate(attentionModuleStudent.myFusedAttention, params, "STUDENT - FUSED ATTENTION")
+    testTemplate(attentionModuleStudent.myFusedAttention, params, "STUDENT - FUSED ATTENTION", causal, dtype)
 
-def part4Test(N, d, B, H, bc, br):
+def part4Test(N, d, B, H, bc, br, causal=False, dtype=torch.float32):
     print("Running Part 4 Test: Flash Attention\n")
     Q,K,V = createQKVSimple(N,d,B,H)
-    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d, False, bc, br)
-    attentionModuleReference = CustomAttention(Q,K,V, B, H, N, d, True, bc, br)
+    attentionModuleStudent = CustomAttention(Q,K,V, B, H, N, d, False, bc, br, causal, dtype)
+    # the reference module needs explicit tile sizes
+    attentionModuleReference = CustomAttention(Q,K,V, B, H, N, d, True, bc or 256, br or 256)
     params = (N, d, B, H)
-    print("-----RUNNING REFERENCE IMPLEMENTATION-----\n")
-    testTemplate(attentionModuleReference.myFlashAttention, params, "REFERENCE - FLASH ATTENTION")
-    time.sleep(3)
+    if causal:
+        print("-----SKIPPING REFERENCE IMPLEMENTATION (no causal mode)-----\n")
+    else:
+        print("-----RUNNING REFERENCE IMPLEMENTATION-----\n")
+        testTemplate(attentionModuleReference.myFlashAttention, params, "REFERENCE - FLASH ATTENTION")
+        time.sleep(3)
     print("-----RUNNING STUDENT IMPLEMENTATION-----\n")
-    testTemplate(attentionModuleStudent.myFlashAttention, params, "STUDENT - FLASH ATTENTION")
+    testTemplate(attentionModuleStudent.myFlashAttention, params, "STUDENT - FLASH ATTENTION", causal, dtype)
+
+def gqaTest(N, d, B, H, kv_heads, causal=False, dtype=torch.float32):
+    print("Running Grouped-Query Attention Test: %d query heads sharing %d KV heads\n" % (H, kv_heads))
+    Q, K, V = createQKVSimple(N, d, B, H)
+    K, V = K[:, :kv_heads], V[:, :kv_heads]
+    # every query head of a group reads the same KV head
+    group = H // kv_heads
+    expected = badSoftmax(Q, K.repeat_interleave(group, dim=1), V.repeat_interleave(group, dim=1), causal)
+    Q, K, V = Q.to(dtype), K.to(dtype), V.to(dtype)
+    kernels = [("fused", lambda: mr.myFusedAttention(Q, K, V, torch.empty(0), B, H, N, d, causal, Hk=kv_heads)),
+               ("flash", lambda: mr.myFlashAttention(Q, K, V, 0, 0, B, H, N, d, causal, Hk=kv_heads))]
+    for name, run in kernels:
+        start = time.time()
+        O = run().float()
+        elapsed = time.time() - start
+        assert torch.allclose(expected, O, atol=ATOL[dtype]), correctness_error_message
+        print("%s: max abs error %.3e, %.3f ms" % (name, (expected - O).abs().max().item(), elapsed * 1000))
+
+def int8Test(N, d, B, H, causal=False, block=64):
+    print("Running Int8 KV Test: flash attention over int8 K and V with one scale per %d rows\n" % block)
+    torch.manual_seed(0)
+    Q, K, V = torch.randn(B, H, N, d), torch.randn(B, H, N, d), torch.randn(B, H, N, d)
+    scale = 1.0 / math.sqrt(d)
+    start = time.time()
+    expected = mr.myFlashAttention(Q, K, V, 0, 0, B, H, N, d, causal, scale)
+    fp32_time = time.time() - start
+    # quantized once, as a KV cache would be, so the timed call only streams int8 tiles
+    Kq, Ks = mr.myQuantizeKV(K, block)
+    Vq, Vs = mr.myQuantizeKV(V, block)
+    start = time.time()
+    O = mr.myFlashAttentionInt8(Q, Kq, Ks, Vq, Vs, block, 0, 0, causal, scale)
+    int8_time = time.time() - start
+    error = (expected - O).abs()
+    relative = ((expected - O).norm() / expected.norm()).item()
+    kv_bytes = 2 * K.numel() * 4
+    int8_bytes = 2 * (Kq.numel() + Ks.numel() * 4)
+    print("K/V storage: fp32 %.2f MB, int8 %.2f MB with scales (%.1fx smaller)" % (kv_bytes / 1e6, int8_bytes / 1e6, kv_bytes / int8_bytes))
+    print("against fp32 flash: max abs error %.3e, mean abs error %.3e, relative error %.3e" % (error.max().item(), error.mean().item(), relative))
+    print("fp32 flash %.3f ms, int8 flash %.3f ms" % (fp32_time * 1000, int8_time * 1000))
+    assert error.max().item() < 2e-2, correctness_error_message
+
+def backwardTest(N, d, B, H, causal=False, dtype=torch.float32):
+    print("Running Backward Test: flash attention gradients by recomputation\n")
+    Q, K, V = (t.contiguous().to(dtype).requires_grad_() for t in createQKVSimple(N, d, B, H))
+    dO = torch.randn(B, H, N, d).to(dtype)
+    # PyTorch keeps the (B, H, N, N) softmax for autograd
+    start = time.time()
+    badSoftmax(Q.float(), K.float(), V.float(), causal).backward(dO.float())
+    pytorch_time = time.time() - start
+    expected = [t.grad.float() for t in (Q, K, V)]
+    start = time.time()
+    O, L = mr.myFlashAttentionForward(Q.detach(), K.detach(), V.detach(), is_causal=causal)
+    grads = mr.myFlashAttentionBackward(Q.detach(), K.detach(), V.detach(), O, dO, L, is_causal=causal)
+    manual_time = time.time() - start
+    for name, grad, ref in zip(("dQ", "dK", "dV"), grads, expected):
+        # gradients sum over rows, so compare relative to their magnitude
+        error = (grad.float() - ref).abs().max().item() / ref.abs().max().item()
+        assert error < 10 * ATOL[dtype], correctness_error_message
+        print("%s max relative error: %.3e" % (name, error))
+    print("\nSaved for backward: %d floats of logsumexp instead of a %d-float attention matrix" % (L.numel(), B * H * N * N))
+    print("PyTorch forward + backward: %.3f ms" % (pytorch_time * 1000))
+    print("Flash forward + backward:   %.3f ms\n" % (manual_time * 1000))
+
+def varlenTest(N, d, H, causal=False, dtype=torch.float32):
+    print("Running Variable-Length Attention Test: packed sequences without padding\n")
+    lengths = [N, N // 3, 1, N // 2 + 7]
+    # each sequence is (1, H, n, d); packing moves the tokens to the front: (n, H, d)
+    sequences = [createQKVSimple(n, d, 1, H) for n in lengths]
+    pack = lambda part: torch.cat([seq[part][0].transpose(0, 1) for seq in sequences]).to(dtype)
+    Q, K, V = pack(0), pack(1), pack(2)
+    cu_seqlens = torch.tensor([0] + lengths, dtype=torch.int32).cumsum(0, dtype=torch.int32)
+    kernels = [("fused", lambda: mr.myFusedAttentionVarlen(Q, K, V, cu_seqlens, causal)),
+               ("flash", lambda: mr.myFlashAttentionVarlen(Q, K, V, cu_seqlens, is_causal=causal))]
+    for name, run in kernels:
+        start = time.time()
+        O = run().float()
+        elapsed = time.time() - start
+        for n, (q, k, v), first in zip(lengths, sequences, cu_seqlens.tolist()):
+            expected = badSoftmax(q, k, v, causal)[0].transpose(0, 1)
+            assert torch.allclose(expected, O[first:first + n], atol=ATOL[dtype]), correctness_error_message
+        print("%s: %d sequences of lengths %s correct, %.3f ms" % (name, len(lengths), lengths, elapsed * 1000))
+    print("\nPadding to N would compute %d query-key pairs per head instead of %d" % (len(lengths) * N * N, sum(n * n for n in lengths)))
+
+def batchedTest(N, d, B, H, causal=False, dtype=torch.float32):
+    print("Running Batched Attention Test: ragged groups in one dispatch\n")
+    # (Nq, Nk) per group; the last is a decode step against a cache of N/2 tokens
+    shapes = [(N, N), (N // 2, N // 2), (N // 4, N // 4), (1, N // 2)]
+    groups = []
+    for Nq, Nk in shapes:
+        Q, _, _ = createQKVSimple(Nq, d, B, H)
+        _, K, V = createQKVSimple(Nk, d, B, H)
+        groups.append((Q.to(dtype), K.to(dtype), V.to(dtype)))
+    start = time.time()
+    for q, k, v in groups:
+        if q.size(2) == k.size(2):
+            mr.myFlashAttention(q, k, v, 0, 0, B, H, q.size(2), d, causal)
+    separate_time = time.time() - start
+    start = time.time()
+    outputs = mr.myBatchedAttention(groups, causal)
+    batched_time = time.time() - start
+    for (q, k, v), O in zip(groups, outputs):
+        expected = badSoftmax(q.float(), k.float(), v.float(), causal)
+        assert torch.allclose(expected, O.float(), atol=ATOL[dtype]), correctness_error_message
+        print("group Nq=%d Nk=%d max abs error: %.3e" % (q.size(2), k.size(2), (expected - O.float()).abs().max().item()))
+    print("\nSeparate flash calls (square groups only): %.3f ms" % (separate_time * 1000))
+    print("Batched Execution Time:                     %.3f ms\n" % (batched_time * 1000))
+
+def tuneTest(N, d, B, H):
+    print("Autotuning tile sizes for N=%d, d=%d at %d threads\n" % (N, d, mr.attentionThreads()))
+    result = mr.autotuneAttention(N, d, B, H)
+    print("flash attention:  Br=%d Bc=%d  %.3f ms" % (result["Br"], result["Bc"], result["flash_ms"]))
+    print("blocked unfused:  block=%d  %.3f ms" % (result["block"], result["blocked_ms"]))
+    print("\nSaved to the tuning cache; kernels called with tile sizes of 0 now use these.")
+
+def printAttentionStats(stats):
+    # cycles are summed over threads, so the phase shares are of the total work, not of wall time
+    print("\nAttention kernel profile:")
+    for kernel, total in stats["kernels"].items():
+        cycles = sum(total["cycles"].values())
+        shares = "  ".join("%s %4.1f%%" % (phase, 100 * c / max(cycles, 1)) for phase, c in total["cycles"].items())
+        print("%-24s %5d calls  %9.3f ms  %7.1f MB read  %6.1f MB written  imbalance %.2f" % (
+            kernel, total["calls"], total["seconds"] * 1000, total["bytes_read"] / 1e6, total["bytes_written"] / 1e6, total["imbalance"]))
+        print("%-24s %s" % ("", shares))
 
 def accessTest(B, H, N, d):
     Q,_ ,_ = createQKVSimple(N,d,B,H)
@@ -266,14 +416,25 @@ def main():
     H=4
     
     parser = argparse.ArgumentParser()
-    parser.add_argument("testname", default="part0", help="name of test to run: part0, part1, part2, part3, part4, 4Daccess")
+    parser.add_argument("testname", default="part0", help="name of test to run: part0, part1, part2, part3, part4, backward, gqa, varlen, batched, int8, 4Daccess, tune")
     parser.add_argument("-m", "--model", default="shakes128", help="name of model to use: shakes128, shakes1024, shakes2048, kayvon")
     parser.add_argument("--inference", action="store_true", default=False, help="run gpt inference")
-    parser.add_argument("-bc",  default="256", help="Flash Attention Bc Size")
-    parser.add_argument("-br", default="256", help="Flash Attention Br Size")
+    parser.add_argument("--kvcache", action="store_true", default=False, help="decode incrementally with the C++ KV cache during inference")
+    parser.add_argument("-bc",  default="0", help="Flash Attention Bc Size (0 = tuned)")
+    parser.add_argument("-br", default="0", help="Flash Attention Br Size (0 = tuned)")
     parser.add_argument("-N", default="1024", help="Flash Attention Br Size")
+    parser.add_argument("--causal", action="store_true", default=False, help="apply a causal mask in part3/part4/backward/gqa/varlen/batched and check against masked PyTorch")
+    parser.add_argument("--schedule", default="auto", help="schedule for part3: auto (NUMA-partitioned work stealing), or an OpenMP static, dynamic or guided, optionally with a chunk size (dynamic,4)")
+    parser.add_argument("--kv-heads", type=int, default=1, help="KV head count for the gqa test; 1 is multi-query attention")
+    parser.add_argument("--isa", default="", help="microkernels to run: scalar, avx2, avx512, avx512bf16, or ispc when module_ispc.o is built (default: best for this CPU)")
+    parser.add_argument("--dtype", default="float32", choices=list(DTYPES), help="Q/K/V dtype for parts 1-4; half-precision results are checked against fp32")
+    parser.add_argument("--profile", action="store_true", default=False, help="print per-phase cycles, bytes moved and load imbalance of the fused/flash kernels")
+    parser.add_argument("--trace", default="", help="also write the kernels' tasks to this file as a Chrome trace (implies --profile)")
 
     args = parser.parse_args()
+    if args.isa:
+        # read once, when the module first needs its kernels
+        environ["ATTN_ISA"] = args.isa
 
     if args.model == "shakes128":
         N = 128
@@ -290,19 +451,35 @@ def main():
     else:
         print("Unknown model name: %s" % args.model)
         return
+    if args.profile or args.trace:
+        mr.setAttentionProfiling(True, bool(args.trace))
     
     if args.inference == False:
+        print("Attention kernels: %s, %d threads\n" % (mr.attentionIsa(), mr.attentionThreads()))
         N = int(args.N)
+        dtype = DTYPES[args.dtype]
         if args.testname == "part0":
             part0Test(N, d, B, H)
         elif args.testname == "part1":
-            part1Test(N, d, B, H)
+            part1Test(N, d, B, H, dtype)
         elif args.testname == "part2":
-            part2Test(N, d, B, H)
+            part2Test(N, d, B, H, dtype)
         elif args.testname == "part3":
-            part3Test(N, d, B, H)
+            part3Test(N, d, B, H, args.causal, dtype, args.schedule)
         elif args.testname == "part4":
-            part4Test(N, d, B, H, int(args.bc), int(args.br))
+            part4Test(N, d, B, H, int(args.bc), int(args.br), args.causal, dtype)
+        elif args.testname == "backward":
+            backwardTest(N, d, B, H, args.causal, dtype)
+        elif args.testname == "gqa":
+            gqaTest(N, d, B, H, args.kv_heads, args.causal, dtype)
+        elif args.testname == "varlen":
+            varlenTest(N, d, H, args.causal, dtype)
+        elif args.testname == "batched":
+            batchedTest(N, d, B, H, args.causal, dtype)
+        elif args.testname == "int8":
+            int8Test(N, d, B, H, args.causal)
+        elif args.testname == "tune":
+            tuneTest(N, d, B, H)
         elif args.testname == "4Daccess":
             accessTest(1, 2, 4, 4)
         else:
@@ -310,7 +487,15 @@ def main():
     else:
         print("Running inference using dnn model %s" % (args.model))
         from sample import run_sample
-        run_sample(N, model_filename, args.testname)
+        run_sample(N, model_filename, args.testname, args.kvcache)
+        if args.testname == "int8":
+            from model import int8_report
+            print(int8_report.summary())
+    if args.profile or args.trace:
+        printAttentionStats(mr.attentionStats())
+    if args.trace:
+        mr.saveAttentionTrace(args.trace)
+        print("\nWrote a Chrome trace to %s (open it in chrome://tracing or ui.perfetto.dev)" % args.trace)
 
         
 if __name__ == "__main__":
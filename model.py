@@ -10,20 +10,56 @@ import time
 import math
 import inspect
 from dataclasses import dataclass
-from os import getcwd, path
 import torch
 import torch.nn as nn
 from torch.nn import functional as F
 
 from torch.utils.cpp_extension import load
+from build_ext import extension_build
 
-NUM_THREADS=8
-torch.set_num_threads(NUM_THREADS)
-
-ispc_path = getcwd() + "/module_ispc.o"
-if not path.exists(ispc_path): ispc_path = ""
-ms = load(name="custom_module", sources=["module.cpp"],  extra_cflags=["-mavx", "-O3", "-fopenmp"], extra_ldflags=[ispc_path])
+sources, extra_ldflags, defines = extension_build()
+ms = load(name="custom_module", sources=sources, extra_cflags=["-mavx", "-O3", "-fopenmp"] + defines, extra_ldflags=extra_ldflags)
+torch.set_num_threads(ms.attentionThreads())
 correctness_error_message = "\n-------------------------------------------\n YOUR ATTENTION PRODUCED INCORRECT RESULTS"
+
+class Int8Report:
+    """ How far the int8 K/V attention outputs land from PyTorch's fp32 attention over a run """
+
+    def __init__(self):
+        self.calls = 0
+        self.max_error = 0.0
+        self.sq_error = 0.0
+        self.sq_expected = 0.0
+
+    def record(self, expected, actual):
+        self.calls += 1
+        self.max_error = max(self.max_error, (expected - actual).abs().max().item())
+        self.sq_error += (expected - actual).pow(2).sum().item()
+        self.sq_expected += expected.pow(2).sum().item()
+
+    def summary(self):
+        relative = math.sqrt(self.sq_error / max(self.sq_expected, 1e-30))
+        return "int8 K/V over %d attention calls: max abs error %.3e, relative error %.3e against fp32" % (
+            self.calls, self.max_error, relative)
+
+int8_report = Int8Report()
+
+class FlashAttentionFunction(torch.autograd.Function):
+    """ Causal flash attention that saves only O and the row logsumexp; backward recomputes the tiles """
+
+    @staticmethod
+    def forward(ctx, q, k, v, scale=1.0):
+        o, lse = ms.myFlashAttentionForward(q, k, v, 0, 0, True, scale)
+        ctx.save_for_backward(q, k, v, o, lse)
+        ctx.scale = scale
+        return o
+
+    @staticmethod
+    def backward(ctx, do):
+        q, k, v, o, lse = ctx.saved_tensors
+        dq, dk, dv = ms.myFlashAttentionBackward(q, k, v, o, do, lse, 0, 0, True, ctx.scale)
+        return dq, dk, dv, None
+
 class LayerNorm(nn.Module):
     """ LayerNorm but with an optional bias. PyTorch doesn't support simply bias=False """
 
@@ -37,7 +73,7 @@ class LayerNorm(nn.Module):
 
 class CausalSelfAttention(nn.Module):
 
-    def __init__(self, config):
+    def __init__(self, config, layer_idx=0):
         super().__init__()
         assert config.n_embd % config.n_head == 0
         # key, query, value projections for all heads, but in a batch
@@ -52,6 +88,8 @@ class CausalSelfAttention(nn.Module):
         self.dropout = config.dropout
         self.block_size = config.block_size
         self.testname = config.testname
+        self.cpp_training = config.cpp_training
+        self.layer_idx = layer_idx
         # flash attention make GPU go brrrrr but support is only in PyTorch >= 2.0
         self.flash =False# hasattr(torch.nn.functional, 'scaled_dot_product_attention')
         
@@ -63,7 +101,7 @@ class CausalSelfAttention(nn.Module):
         self.custom_attn_inference_time = 0
         self.python_inference_time = 0
 
-    def forward(self, x):
+    def forward(self, x, kv_cache=None):
         B, T, C = x.size() # batch size, sequence length, embedding dimensionality (n_embd)
 
         # calculate query, key, values for all heads in batch and move head forward to be the batch dim
@@ -75,7 +113,19 @@ class CausalSelfAttention(nn.Module):
         H = self.n_head
         d = C // self.n_head
         # causal self-attention; Self-attend: (B, nh, T, hs) x (B, nh, hs, T) -> (B, nh, T, T)
-        if self.flash:
+        if kv_cache is not None:
+            # incremental decode: cache this step's k, v and attend only the T new rows of q
+            start_time = time.time()
+            kv_cache.append(self.layer_idx, k, v)
+            y = kv_cache.attend(self.layer_idx, q)
+            end_time = time.time()
+            self.custom_attn_inference_time += end_time - start_time
+        elif self.training and self.cpp_training and self.dropout == 0.0 and q.device.type == "cpu":
+            # opt-in CPU training: no (B, nh, T, T) attention matrix is kept for autograd; the
+            # softmax scale stays at the kernels' default of 1.0, the unscaled q @ k^T every
+            # inference path here (manual, part3/part4, int8 and the KV cache) computes
+            y = FlashAttentionFunction.apply(q, k, v)
+        elif self.flash:
             # efficient attention using Flash Attention CUDA kernels
             y = torch.nn.functional.scaled_dot_product_attention(q, k, v, attn_mask=None, dropout_p=self.dropout if self.training else 0, is_causal=True)
         else:
@@ -106,29 +156,31 @@ class CausalSelfAttention(nn.Module):
                 att2 = ms.myUnfusedAttentionBlocked(q, k, v, temp, B, H, N, d)
             elif self.testname == "part3":
                 # part3Test(N, d, B, H)
-                temp = torch.zeros((NUM_THREADS, N))
-                att2 = ms.myFusedAttention(q, k, v, temp, B, H, N, d)
+                temp = torch.empty(0) # unused, the module keeps its own row scratch
+                att2 = ms.myFusedAttention(q, k, v, temp, B, H, N, d, True)
             elif self.testname == "part4":
-                # part4Test(N, d, B, H, block_size)
-                bs = 128
-                Qi = torch.zeros((bs, d))
-                Kj = torch.zeros((bs, d))
-                Vj = torch.zeros((bs, d))
-                Sij = torch.zeros((bs, bs))
-                Pij = torch.zeros((bs, bs))
-                PV = torch.zeros((bs, d))
-                Oi = torch.zeros((bs, d))
-                L = torch.zeros((N))
-                Lnew = torch.zeros((bs))
-                Lij = torch.zeros((bs))
-                Li = torch.zeros((bs))
-                att2 = ms.myFlashAttention(q, k, v, Qi, Kj, Vj, Sij, Pij, PV, Oi, L, Li, Lij, Lnew, bs, bs, B, H, N, d)
+                # part4Test(N, d, B, H); tile sizes of 0 use the tuned ones
+                att2 = ms.myFlashAttention(q, k, v, 0, 0, B, H, N, d, True)
+            elif self.testname == "int8":
+                # K and V stored as int8 with one scale per 64 rows of each head
+                kq, ks = ms.myQuantizeKV(k)
+                vq, vs = ms.myQuantizeKV(v)
+                att2 = ms.myFlashAttentionInt8(q, kq, ks, vq, vs, 64, 0, 0, True)
             else:
                 print("Unknown test name: %s" % self.testname)
             
             end_time = time.time()  # Store start time
             self.custom_attn_inference_time += end_time - start_time
-            assert torch.allclose(y_comp, att2, atol=1e-02,), correctness_error_message
+            if self.testname in ("part3", "part4"):
+                # these kernels apply the causal mask themselves, so they replace the masked path
+                assert torch.allclose(y, att2, atol=1e-02,), correctness_error_message
+                y = att2
+            elif self.testname == "int8":
+                # quantized K/V are lossy: record the error instead of asserting and generate with them
+                int8_report.record(y, att2)
+                y = att2
+            else:
+                assert torch.allclose(y_comp, att2, atol=1e-02,), correctness_error_message
 
         y = y.transpose(1, 2).contiguous().view(B, T, C) # re-assemble all head outputs side by side
         y = self.resid_dropout(self.c_proj(y))
@@ -152,15 +204,15 @@ class MLP(nn.Module):
 
 class Block(nn.Module):
 
-    def __init__(self, config):
+    def __init__(self, config, layer_idx=0):
         super().__init__()
         self.ln_1 = LayerNorm(config.n_embd, bias=config.bias)
-        self.attn = CausalSelfAttention(config)
+        self.attn = CausalSelfAttention(config, layer_idx)
         self.ln_2 = LayerNorm(config.n_embd, bias=config.bias)
         self.mlp = MLP(config)
 
-    def forward(self, x):
-        x = x + self.attn(self.ln_1(x))
+    def forward(self, x, kv_cache=None):
+        x = x + self.attn(self.ln_1(x), kv_cache)
         x = x + self.mlp(self.ln_2(x))
         return x
 
@@ -175,6 +227,7 @@ class GPTConfig:
     bias: bool = True # True: bias in Linears and LayerNorms, like GPT-2. False: a bit better and faster
     use_cpp: bool = False # legacy but we keep it because the 2048 model was trained with this
     testname: str = "part0"
+    cpp_training: bool = False # train on the CPU with the C++ flash attention forward/backward
     
 class GPT(nn.Module):
 
@@ -188,7 +241,7 @@ class GPT(nn.Module):
             wte = nn.Embedding(config.vocab_size, config.n_embd),
             wpe = nn.Embedding(config.block_size, config.n_embd),
             drop = nn.Dropout(config.dropout),
-            h = nn.ModuleList([Block(config) for _ in range(config.n_layer)]),
+            h = nn.ModuleList([Block(config, i) for i in range(config.n_layer)]),
             ln_f = LayerNorm(config.n_embd, bias=config.bias),
         ))
         self.lm_head = nn.Linear(config.n_embd, config.vocab_size, bias=False)
@@ -229,11 +282,13 @@ class GPT(nn.Module):
         elif isinstance(module, nn.Embedding):
             torch.nn.init.normal_(module.weight, mean=0.0, std=0.02)
 
-    def forward(self, idx, targets=None):
+    def forward(self, idx, targets=None, kv_cache=None):
         device = idx.device
         b, t = idx.size()
-        assert t <= self.config.block_size, f"Cannot forward sequence of length {t}, block size is only {self.config.block_size}"
-        pos = torch.arange(0, t, dtype=torch.long, device=device) # shape (t)
+        # with a KV cache, idx holds only the tokens after the ones already cached
+        start = kv_cache.length(0) if kv_cache is not None else 0
+        assert start + t <= self.config.block_size, f"Cannot forward sequence of length {start + t}, block size is only {self.config.block_size}"
+        pos = torch.arange(start, start + t, dtype=torch.long, device=device) # shape (t)
         # forward the GPT model itself
         tok_emb = self.transformer.wte(idx) # token embeddings of shape (b, t, n_embd)
         pos_emb = self.transformer.wpe(pos) # position embeddings of shape (t, n_embd)
@@ -241,7 +296,7 @@ class GPT(nn.Module):
         
         self.forward_times += 1
         for block in self.transformer.h:
-            x = block(x)
+            x = block(x, kv_cache)
         x = self.transformer.ln_f(x)
 
         if targets is not None:
@@ -366,17 +421,29 @@ class GPT(nn.Module):
         return mfu
 
     @torch.no_grad()
-    def generate(self, idx, max_new_tokens, decode, temperature=1.0, top_k=None):
+    def generate(self, idx, max_new_tokens, decode, temperature=1.0, top_k=None, use_kv_cache=False):
         """
         Take a conditioning sequence of indices idx (LongTensor of shape (b,t)) and complete
         the sequence max_new_tokens times, feeding the predictions back into the model each time.
         Most likely you'll want to make sure to be in model.eval() mode of operation for this.
+        With use_kv_cache, keys and values are kept in the C++ KVCache and each step after the
+        first only runs the newest token through the model.
         """
+        kv_cache = None
+        if use_kv_cache:
+            head_dim = self.config.n_embd // self.config.n_head
+            kv_cache = ms.KVCache(self.config.n_layer, idx.size(0), self.config.n_head, self.config.block_size, head_dim)
         for _ in range(max_new_tokens):
             # if the sequence context is growing too long we must crop it at block_size
             idx_cond = idx if idx.size(1) <= self.config.block_size else idx[:, -self.config.block_size:]
+            if kv_cache is not None:
+                if kv_cache.length(0) > 0 and idx.size(1) <= self.config.block_size:
+                    idx_cond = idx[:, -1:]
+                else:
+                    # first step, or the window slid and every position moved: rebuild the cache
+                    kv_cache.reset()
             # forward the model to get the logits for the index in the sequence
-            logits, _ = self(idx_cond)
+            logits, _ = self(idx_cond, kv_cache=kv_cache)
             # pluck the logits at the final step and scale by desired temperature
             logits = logits[:, -1, :] / temperature
             # optionally crop the logits to only the top k options
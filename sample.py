@@ -8,7 +8,7 @@ import torch
 import tiktoken
 from model import GPTConfig, GPT
 
-def run_sample(N, out_dir, testname):
+def run_sample(N, out_dir, testname, use_kv_cache=False):
     # -----------------------------------------------------------------------------
     init_from = 'resume' # either 'resume' (from an out_dir) or a gpt2 variant (e.g. 'gpt2-xl')
     # out_dir = 'out' # ignored if init_from is not 'resume'
@@ -90,7 +90,7 @@ def run_sample(N, out_dir, testname):
     with torch.no_grad():
         with ctx:
             for k in range(num_samples):
-                y = model.generate(x, max_new_tokens, decode, temperature=temperature, top_k=top_k)
+                y = model.generate(x, max_new_tokens, decode, temperature=temperature, top_k=top_k, use_kv_cache=use_kv_cache)
                 #print(decode(y[0].tolist()))
                 print('\n-------------------------------------------------------------')
 